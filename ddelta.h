@@ -6,12 +6,31 @@
 
 /* Fork of BSDIFF that does not compress ctrl, diff, extra blocks */
 #define DDELTA_MAGIC "DDELTA40"
+/* Extended format: the header is followed by the filter applied to the
+ * files, and entries may use the DDELTA_DIFF_ZERO and DDELTA_EXTRA_ZERO
+ * flags */
+#define DDELTA_MAGIC_EXTENDED "DDELTA41"
+
+/**
+ * Filters converting relative branch targets in executables to absolute
+ * ones, so that code which merely moved produces matching bytes.
+ */
+enum ddelta_filter {
+    DDELTA_FILTER_NONE = 0,
+    /** CALL and JMP instructions on x86 and x86-64 */
+    DDELTA_FILTER_X86,
+    /** BL instructions on ARM64 */
+    DDELTA_FILTER_ARM64
+};
 
 /**
  * A ddelta file has the following format:
  *
  * * the header
  * * a list of entries
+ *
+ * With the DDELTA_MAGIC_EXTENDED magic, the header is followed by a
+ * uint64_t naming the ddelta_filter, see ddelta_header_read_filter().
  */
 struct ddelta_header {
     char magic[8];
@@ -23,6 +42,14 @@ struct ddelta_header {
  *
  * 1. 'diff' bytes of diff data
  * 2. 'extra' bytes of extra data
+ *
+ * In the extended format, if DDELTA_DIFF_ZERO is set in 'diff', the diff
+ * data consists only of zeroes and is omitted from the patch: The remaining
+ * bits of 'diff' then specify how many bytes to copy unchanged from the old
+ * file.
+ *
+ * Likewise, if DDELTA_EXTRA_ZERO is set in 'extra', the extra data consists
+ * only of zeroes and is omitted from the patch.
  */
 struct ddelta_entry_header {
     uint64_t diff;
@@ -33,6 +60,11 @@ struct ddelta_entry_header {
     } seek;
 };
 
+/** Flag in ddelta_entry_header.diff marking an all-zero (omitted) diff */
+#define DDELTA_DIFF_ZERO ((uint64_t) 1 << 63)
+/** Flag in ddelta_entry_header.extra marking all-zero (omitted) extra */
+#define DDELTA_EXTRA_ZERO ((uint64_t) 1 << 63)
+
 /* Static assertions that the headers have the correct size. */
 typedef int ddelta_assert_header_size[sizeof(struct ddelta_header) == 16 ? 1 : -1];
 typedef int ddelta_assert_entry_header_size[sizeof(struct ddelta_entry_header) == 24 ? 1 : -1];
@@ -68,6 +100,13 @@ enum ddelta_error {
  */
 int ddelta_generate(int oldfd, int newfd, int patchfd);
 
+/**
+ * Like ddelta_generate(), but applies the given ddelta_filter to the old
+ * and new file before diffing them.
+ */
+int ddelta_generate_filtered(int oldfd, int newfd, int patchfd,
+                             enum ddelta_filter filter);
+
 /**
  * Read a header from the given file.
  *
@@ -76,10 +115,17 @@ int ddelta_generate(int oldfd, int newfd, int patchfd);
  *
  * @return 0 on success,
  *         -DDELTA_EPATCHIO on I/O errors,
- *         -DDELTA_EMAGIC if it is not a ddelta file
+ *         -DDELTA_EMAGIC if it is not a ddelta file, or uses a filter
  */
 int ddelta_header_read(struct ddelta_header *header, FILE *patchfd);
 
+/**
+ * Like ddelta_header_read(), but accepts patches using a filter, and stores
+ * the filter to pass to ddelta_apply_filtered() in *filter.
+ */
+int ddelta_header_read_filter(struct ddelta_header *header,
+                              enum ddelta_filter *filter, FILE *patchfd);
+
 /**
  * Generates a new file from a given patch and an old file.
  *
@@ -87,4 +133,13 @@ int ddelta_header_read(struct ddelta_header *header, FILE *patchfd);
  */
 int ddelta_apply(struct ddelta_header *header, FILE *patchfd, FILE *oldfd, FILE *newfd);
 
+/**
+ * Like ddelta_apply(), for a patch using the given filter.
+ *
+ * If the patch uses a filter, a filtered copy of the old file is written
+ * to a temporary file first.
+ */
+int ddelta_apply_filtered(struct ddelta_header *header, enum ddelta_filter filter,
+                          FILE *patchfd, FILE *oldfd, FILE *newfd);
+
 #endif
@@ -24,12 +24,34 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* Copy unchanged data in the kernel with copy_file_range() where possible,
+ * and create holes in the new file instead of writing out zeroes. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#ifndef DDELTA_NO_COPY_FILE_RANGE
+#define DDELTA_HAVE_COPY_FILE_RANGE 1
+#endif
+#ifndef DDELTA_NO_SPARSE
+#define DDELTA_HAVE_SPARSE 1
+#endif
+#endif
+
 #include "ddelta.h"
+#include "ddelta_filter.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#if defined(DDELTA_HAVE_COPY_FILE_RANGE) || defined(DDELTA_HAVE_SPARSE)
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifndef MIN
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
@@ -39,6 +61,23 @@
 #define DDELTA_BLOCK_SIZE (32 * 1024)
 #endif
 
+/**
+ * A file written through a ddelta_filter.
+ *
+ * Up to a few bytes at the end of each write may form an incomplete
+ * instruction; those are held back in buf until more data arrives.
+ */
+struct ddelta_filter_stream {
+    FILE *file;
+    struct ddelta_filter_state filter;
+    /** Offset of buf[0] in the file */
+    uint64_t pos;
+    size_t pending;
+    unsigned char buf[DDELTA_BLOCK_SIZE + 8];
+    /** Whether holes were created by seeking, possibly past the end */
+    int holes;
+};
+
 static uint64_t ddelta_be64toh(uint64_t be64)
 {
 #if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -64,17 +103,40 @@ static int64_t ddelta_from_unsigned(uint64_t u)
     return u & 0x80000000 ? -(int64_t) ~(u - 1) : (int64_t) u;
 }
 
-int ddelta_header_read(struct ddelta_header *header, FILE *file)
+int ddelta_header_read_filter(struct ddelta_header *header,
+                              enum ddelta_filter *filter, FILE *file)
 {
+    uint64_t value = DDELTA_FILTER_NONE;
+
     if (fread(header, sizeof(*header), 1, file) < 1)
         return -DDELTA_EPATCHIO;
-    if (memcmp(DDELTA_MAGIC, header->magic, sizeof(header->magic)) != 0)
+
+    if (memcmp(DDELTA_MAGIC_EXTENDED, header->magic, sizeof(header->magic)) == 0) {
+        if (fread(&value, sizeof(value), 1, file) < 1)
+            return -DDELTA_EPATCHIO;
+        value = ddelta_be64toh(value);
+        if (value > DDELTA_FILTER_ARM64)
+            return -DDELTA_EMAGIC;
+    } else if (memcmp(DDELTA_MAGIC, header->magic, sizeof(header->magic)) != 0) {
         return -DDELTA_EMAGIC;
+    }
 
     header->new_file_size = ddelta_be64toh(header->new_file_size);
+    *filter = (enum ddelta_filter) value;
     return 0;
 }
 
+int ddelta_header_read(struct ddelta_header *header, FILE *file)
+{
+    enum ddelta_filter filter;
+    int err;
+
+    if ((err = ddelta_header_read_filter(header, &filter, file)) < 0)
+        return err;
+
+    return filter == DDELTA_FILTER_NONE ? 0 : -DDELTA_EMAGIC;
+}
+
 int ddelta_entry_header_read(struct ddelta_entry_header *entry,
                              FILE *file)
 {
@@ -87,7 +149,157 @@ int ddelta_entry_header_read(struct ddelta_entry_header *entry,
     return 0;
 }
 
-static int apply_diff(FILE *patchfd, FILE *oldfd, FILE *newfd, uint64_t size)
+/**
+ * Write to a filter stream, like fwrite() with a size of 1.
+ */
+static size_t filter_write(struct ddelta_filter_stream *stream,
+                           const void *data, size_t size)
+{
+    const unsigned char *in = data;
+    size_t remaining = size;
+
+    if (stream->filter.filter == DDELTA_FILTER_NONE)
+        return fwrite(data, 1, size, stream->file);
+
+    while (remaining > 0) {
+        size_t n = MIN(sizeof(stream->buf) - stream->pending, remaining);
+        size_t done;
+
+        memcpy(stream->buf + stream->pending, in, n);
+        stream->pending += n;
+        in += n;
+        remaining -= n;
+
+        done = ddelta_filter_code(&stream->filter, stream->pos, stream->buf,
+                                  stream->pending);
+        if (fwrite(stream->buf, 1, done, stream->file) < done)
+            return 0;
+
+        memmove(stream->buf, stream->buf + done, stream->pending - done);
+        stream->pending -= done;
+        stream->pos += done;
+    }
+
+    return size;
+}
+
+/**
+ * Write out the held back bytes of a filter stream and flush it.
+ */
+static int filter_flush(struct ddelta_filter_stream *stream)
+{
+    if (fwrite(stream->buf, 1, stream->pending, stream->file) < stream->pending)
+        return EOF;
+
+    stream->pos += stream->pending;
+    stream->pending = 0;
+    if (fflush(stream->file) != 0)
+        return EOF;
+
+#ifdef DDELTA_HAVE_SPARSE
+    /* Extend the file over holes at its end */
+    if (stream->holes) {
+        struct stat st;
+        off_t pos;
+
+        if ((pos = ftello(stream->file)) < 0 ||
+            fstat(fileno(stream->file), &st) < 0 ||
+            (st.st_size < pos && ftruncate(fileno(stream->file), pos) < 0))
+            return EOF;
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef DDELTA_HAVE_SPARSE
+/**
+ * Turn a range of a regular file into a hole.
+ *
+ * Parts of the range past the end of the file are left alone; they become
+ * a hole when the file is extended by filter_flush().
+ */
+static int punch_hole(int fd, off_t offset, off_t size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+    if (offset < st.st_size &&
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  MIN(size, st.st_size - offset)) < 0)
+        return -1;
+
+    return 0;
+}
+#endif
+
+/**
+ * Write zeroes to a filter stream, by creating a hole where possible.
+ */
+static int write_zeros(struct ddelta_filter_stream *stream, uint64_t size)
+{
+    static const char zeros[DDELTA_BLOCK_SIZE];
+
+#ifdef DDELTA_HAVE_SPARSE
+    off_t pos;
+
+    if (stream->filter.filter == DDELTA_FILTER_NONE && fflush(stream->file) == 0 &&
+        (pos = ftello(stream->file)) >= 0 &&
+        punch_hole(fileno(stream->file), pos, size) == 0 &&
+        fseeko(stream->file, pos + size, SEEK_SET) == 0) {
+        stream->holes = 1;
+        return 0;
+    }
+#endif
+
+    while (size > 0) {
+        uint64_t towrite = MIN(sizeof(zeros), size);
+
+        if (filter_write(stream, zeros, towrite) < towrite)
+            return -DDELTA_ENEWIO;
+
+        size -= towrite;
+    }
+    return 0;
+}
+
+/**
+ * Create a temporary copy of the rest of oldfd with the filter applied.
+ */
+static FILE *filter_old(enum ddelta_filter filter, FILE *oldfd)
+{
+    struct ddelta_filter_stream stream;
+    char buf[DDELTA_BLOCK_SIZE];
+    size_t n;
+
+    stream.file = tmpfile();
+    ddelta_filter_init(&stream.filter, filter, 1);
+    stream.pos = 0;
+    stream.pending = 0;
+    stream.holes = 0;
+
+    if (stream.file == NULL)
+        return NULL;
+
+    while ((n = fread(&buf, 1, sizeof(buf), oldfd)) > 0) {
+        if (filter_write(&stream, &buf, n) < n)
+            goto fail;
+    }
+
+    if (ferror(oldfd) || filter_flush(&stream) != 0 ||
+        fseek(stream.file, 0, SEEK_SET) < 0)
+        goto fail;
+
+    return stream.file;
+
+fail:
+    fclose(stream.file);
+    return NULL;
+}
+
+static int apply_diff(FILE *patchfd, FILE *oldfd,
+                      struct ddelta_filter_stream *newfd, uint64_t size)
 {
 #ifdef __GNUC__
     typedef unsigned char uchar_vector __attribute__((vector_size(16)));
@@ -113,7 +325,7 @@ static int apply_diff(FILE *patchfd, FILE *oldfd, FILE *newfd, uint64_t size)
         for (i = 0; i < items_to_add; i++)
             old[i] += patch[i];
 
-        if (fwrite(&old, 1, toread, newfd) < toread)
+        if (filter_write(newfd, &old, toread) < toread)
             return -DDELTA_ENEWIO;
 
         size -= toread;
@@ -122,7 +334,7 @@ static int apply_diff(FILE *patchfd, FILE *oldfd, FILE *newfd, uint64_t size)
     return 0;
 }
 
-static int copy_bytes(FILE *a, FILE *b, uint64_t bytes)
+static int copy_bytes(FILE *a, struct ddelta_filter_stream *b, uint64_t bytes)
 {
     char buf[DDELTA_BLOCK_SIZE];
     while (bytes > 0) {
@@ -130,7 +342,7 @@ static int copy_bytes(FILE *a, FILE *b, uint64_t bytes)
 
         if (fread(&buf, toread, 1, a) < 1)
             return -DDELTA_EPATCHIO;
-        if (fwrite(&buf, toread, 1, b) < 1)
+        if (filter_write(b, &buf, toread) < toread)
             return -DDELTA_ENEWIO;
 
         bytes -= toread;
@@ -138,6 +350,111 @@ static int copy_bytes(FILE *a, FILE *b, uint64_t bytes)
     return 0;
 }
 
+/**
+ * Copy bytes unchanged from the old file to the new file in userspace.
+ */
+static int copy_old_bytes(FILE *oldfd, struct ddelta_filter_stream *newfd, uint64_t size)
+{
+    char buf[DDELTA_BLOCK_SIZE];
+
+    while (size > 0) {
+        uint64_t toread = MIN(sizeof(buf), size);
+
+        if (fread(&buf, toread, 1, oldfd) < 1)
+            return -DDELTA_EOLDIO;
+        if (filter_write(newfd, &buf, toread) < toread)
+            return -DDELTA_ENEWIO;
+
+        size -= toread;
+    }
+    return 0;
+}
+
+/**
+ * Copy bytes unchanged from the old file to the new file.
+ *
+ * This is used for diff data consisting of zeroes only. If possible, holes
+ * in the old file are recreated in the new file, and the copy of the data
+ * is offloaded to the kernel, which may share the blocks via reflinks on
+ * file systems supporting them.
+ */
+static int copy_old(FILE *oldfd, struct ddelta_filter_stream *newfd, uint64_t size)
+{
+#if defined(DDELTA_HAVE_COPY_FILE_RANGE) || defined(DDELTA_HAVE_SPARSE)
+    loff_t in, out;
+    int err;
+#ifdef DDELTA_HAVE_COPY_FILE_RANGE
+    int use_copy_file_range = 1;
+#endif
+
+    if (size < DDELTA_BLOCK_SIZE || newfd->filter.filter != DDELTA_FILTER_NONE ||
+        fflush(newfd->file) != 0 ||
+        (in = ftello(oldfd)) < 0 || (out = ftello(newfd->file)) < 0)
+        return copy_old_bytes(oldfd, newfd, size);
+
+    while (size > 0) {
+        uint64_t chunk = MIN(size, DDELTA_BLOCK_SIZE * 1024);
+#ifdef DDELTA_HAVE_SPARSE
+        struct stat st;
+        off_t data, hole;
+
+        data = lseek(fileno(oldfd), in, SEEK_DATA);
+        if (data < 0 && errno == ENXIO && fstat(fileno(oldfd), &st) == 0 &&
+            in + (off_t) size <= st.st_size)
+            data = in + size;
+
+        if (data > in) {
+            chunk = MIN(chunk, (uint64_t) (data - in));
+            if (punch_hole(fileno(newfd->file), out, chunk) == 0) {
+                newfd->holes = 1;
+                in += chunk;
+                out += chunk;
+                size -= chunk;
+                continue;
+            }
+        } else if (data == in && (hole = lseek(fileno(oldfd), in, SEEK_HOLE)) > in) {
+            chunk = MIN(chunk, (uint64_t) (hole - in));
+        }
+#endif
+#ifdef DDELTA_HAVE_COPY_FILE_RANGE
+        if (use_copy_file_range) {
+            ssize_t n = copy_file_range(fileno(oldfd), &in, fileno(newfd->file),
+                                        &out, chunk, 0);
+            if (n > 0) {
+                size -= n;
+                continue;
+            }
+            use_copy_file_range = 0;
+        }
+#endif
+
+        /* Copy in userspace, with the streams moved to the offsets */
+        if (fseeko(oldfd, in, SEEK_SET) < 0)
+            return -DDELTA_EOLDIO;
+        if (fseeko(newfd->file, out, SEEK_SET) < 0)
+            return -DDELTA_ENEWIO;
+        if ((err = copy_old_bytes(oldfd, newfd, chunk)) < 0)
+            return err;
+        if (fflush(newfd->file) != 0)
+            return -DDELTA_ENEWIO;
+
+        in += chunk;
+        out += chunk;
+        size -= chunk;
+    }
+
+    /* Sync the streams with the offsets */
+    if (fseeko(oldfd, in, SEEK_SET) < 0)
+        return -DDELTA_EOLDIO;
+    if (fseeko(newfd->file, out, SEEK_SET) < 0)
+        return -DDELTA_ENEWIO;
+
+    return 0;
+#else
+    return copy_old_bytes(oldfd, newfd, size);
+#endif
+}
+
 /**
  * Apply a ddelta_apply in patchfd to oldfd, writing to newfd.
  *
@@ -145,33 +462,86 @@ static int copy_bytes(FILE *a, FILE *b, uint64_t bytes)
  * sequentially.
  */
 int ddelta_apply(struct ddelta_header *header, FILE *patchfd, FILE *oldfd, FILE *newfd)
+{
+    return ddelta_apply_filtered(header, DDELTA_FILTER_NONE, patchfd, oldfd, newfd);
+}
+
+int ddelta_apply_filtered(struct ddelta_header *header, enum ddelta_filter filter,
+                          FILE *patchfd, FILE *oldfd, FILE *newfd)
 {
     struct ddelta_entry_header entry;
+    struct ddelta_filter_stream stream;
+    FILE *filtered = NULL;
     int err;
     uint64_t bytes_written = 0;
+    uint64_t diff, extra;
+    int extended = memcmp(DDELTA_MAGIC, header->magic, sizeof(header->magic)) != 0;
+
+    if (filter > DDELTA_FILTER_ARM64)
+        return -DDELTA_EMAGIC;
+
+    /* The diff was generated against the filtered old file */
+    if (filter != DDELTA_FILTER_NONE) {
+        if ((filtered = filter_old(filter, oldfd)) == NULL)
+            return -DDELTA_EOLDIO;
+        oldfd = filtered;
+    }
+
+    stream.file = newfd;
+    ddelta_filter_init(&stream.filter, filter, 0);
+    stream.pos = 0;
+    stream.pending = 0;
+    stream.holes = 0;
 
     while (ddelta_entry_header_read(&entry, patchfd) == 0) {
         if (entry.diff == 0 && entry.extra == 0 && entry.seek.value == 0) {
-            fflush(newfd);
-            return bytes_written == header->new_file_size ? 0 : -DDELTA_EPATCHSHORT;
+            if (filter_flush(&stream) != 0)
+                err = -DDELTA_ENEWIO;
+            else
+                err = bytes_written == header->new_file_size ? 0 : -DDELTA_EPATCHSHORT;
+            goto out;
         }
 
-        if ((err = apply_diff(patchfd, oldfd, newfd, entry.diff)) < 0)
-            return err;
+        /* The old format has no flags, these would be invalid sizes */
+        if (!extended && ((entry.diff & DDELTA_DIFF_ZERO) ||
+                          (entry.extra & DDELTA_EXTRA_ZERO))) {
+            err = -DDELTA_EPATCHIO;
+            goto out;
+        }
+
+        diff = entry.diff & ~DDELTA_DIFF_ZERO;
+        if (entry.diff & DDELTA_DIFF_ZERO)
+            err = copy_old(oldfd, &stream, diff);
+        else
+            err = apply_diff(patchfd, oldfd, &stream, diff);
+        if (err < 0)
+            goto out;
 
         /* Copy the bytes over */
-        if ((err = copy_bytes(patchfd, newfd, entry.extra)) < 0)
-            return err;
+        extra = entry.extra & ~DDELTA_EXTRA_ZERO;
+        if (entry.extra & DDELTA_EXTRA_ZERO)
+            err = write_zeros(&stream, extra);
+        else
+            err = copy_bytes(patchfd, &stream, extra);
+        if (err < 0)
+            goto out;
 
         /* Skip remaining bytes */
         if (fseek(oldfd, entry.seek.value, SEEK_CUR) < 0) {
-            return -DDELTA_EOLDIO;
+            err = -DDELTA_EOLDIO;
+            goto out;
         }
 
-        bytes_written += entry.diff + entry.extra;
+        bytes_written += diff + extra;
     }
 
-    return -DDELTA_EPATCHIO;
+    err = -DDELTA_EPATCHIO;
+
+out:
+    if (filtered != NULL)
+        fclose(filtered);
+
+    return err;
 }
 
 #ifndef DDELTA_NO_MAIN
@@ -181,6 +551,7 @@ int main(int argc, char *argv[])
     FILE *new;
     FILE *patch;
     struct ddelta_header header;
+    enum ddelta_filter filter;
 
     if (argc != 4) {
         fprintf(stderr, "usage: %s oldfile newfile patchfile\n", argv[0]);
@@ -197,10 +568,10 @@ int main(int argc, char *argv[])
     if (patch == NULL)
         return perror("Cannot open patch"), 1;
 
-    if (ddelta_header_read(&header, patch) < 0)
+    if (ddelta_header_read_filter(&header, &filter, patch) < 0)
         return fprintf(stderr, "Not a ddelta file"), 1;
 
-    printf("Result: %d\n", ddelta_apply(&header, patch, old, new));
+    printf("Result: %d\n", ddelta_apply_filtered(&header, filter, patch, old, new));
 
     return 0;
 }
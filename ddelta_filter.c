@@ -0,0 +1,179 @@
+/* ddelta_filter.c - Branch conversion filters for executables
+ *
+ * Copyright (C) 2017 Julian Andres Klode <jak@debian.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ddelta_filter.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+static uint32_t ddelta_le32toh(const unsigned char *buf)
+{
+    return (uint32_t) buf[0] << 0 |
+           (uint32_t) buf[1] << 8 |
+           (uint32_t) buf[2] << 16 |
+           (uint32_t) buf[3] << 24;
+}
+
+static void ddelta_htole32(unsigned char *buf, uint32_t host)
+{
+    buf[0] = (host >> 0) & 0xFF;
+    buf[1] = (host >> 8) & 0xFF;
+    buf[2] = (host >> 16) & 0xFF;
+    buf[3] = (host >> 24) & 0xFF;
+}
+
+#define TEST_86_MS_BYTE(b) ((b) == 0x00 || (b) == 0xFF)
+
+/* Converts the 32-bit displacement of relative CALL (E8) and JMP (E9)
+ * instructions, like the x86 BCJ filter of xz. Only displacements whose
+ * most significant byte is 0x00 or 0xFF are converted, and prev_mask tracks
+ * the E8/E9 bytes seen in the four bytes before an opcode, so that bytes
+ * which are more likely part of another instruction are left alone. A
+ * converted displacement keeps a most significant byte of 0x00 or 0xFF, and
+ * opcodes that were not converted are not modified, so decoding makes the
+ * same decisions as encoding. */
+static size_t x86_code(struct ddelta_filter_state *state, uint64_t pos,
+                       unsigned char *buf, size_t size)
+{
+    static const int mask_to_allowed_status[8] = { 1, 1, 1, 0, 1, 0, 0, 0 };
+    static const uint32_t mask_to_bit_number[8] = { 0, 1, 2, 2, 3, 3, 3, 3 };
+    uint32_t prev_mask = state->prev_mask;
+    uint32_t prev_pos = state->prev_pos;
+    uint32_t now_pos = (uint32_t) pos;
+    size_t i;
+
+    if (size < 5)
+        return 0;
+
+    if (now_pos - prev_pos > 5)
+        prev_pos = now_pos - 5;
+
+    for (i = 0; i + 5 <= size;) {
+        uint32_t offset, src, dest;
+        unsigned char b = buf[i];
+
+        if (b != 0xE8 && b != 0xE9) {
+            i++;
+            continue;
+        }
+
+        offset = now_pos + (uint32_t) i - prev_pos;
+        prev_pos = now_pos + (uint32_t) i;
+
+        if (offset > 5) {
+            prev_mask = 0;
+        } else {
+            uint32_t j;
+
+            for (j = 0; j < offset; j++) {
+                prev_mask &= 0x77;
+                prev_mask <<= 1;
+            }
+        }
+
+        b = buf[i + 4];
+
+        if (!TEST_86_MS_BYTE(b) || !mask_to_allowed_status[(prev_mask >> 1) & 0x7] ||
+            (prev_mask >> 1) >= 0x10) {
+            i++;
+            prev_mask |= 1;
+            if (TEST_86_MS_BYTE(b))
+                prev_mask |= 0x10;
+            continue;
+        }
+
+        src = ddelta_le32toh(buf + i + 1);
+
+        for (;;) {
+            uint32_t n;
+
+            dest = state->encode ? src + (now_pos + (uint32_t) i + 5)
+                                 : src - (now_pos + (uint32_t) i + 5);
+            if (prev_mask == 0)
+                break;
+
+            n = mask_to_bit_number[prev_mask >> 1];
+            b = (unsigned char) (dest >> (24 - n * 8));
+            if (!TEST_86_MS_BYTE(b))
+                break;
+
+            src = dest ^ ((1U << (32 - n * 8)) - 1);
+        }
+
+        /* Sign-extend bit 24 into the most significant byte */
+        dest = (dest & 0x01FFFFFF) | (dest & 0x01000000 ? 0xFE000000 : 0);
+        ddelta_htole32(buf + i + 1, dest);
+        i += 5;
+        prev_mask = 0;
+    }
+
+    state->prev_mask = prev_mask;
+    state->prev_pos = prev_pos;
+    return i;
+}
+
+/* Converts the 26-bit word offset of BL instructions. */
+static size_t arm64_code(struct ddelta_filter_state *state, uint64_t pos,
+                         unsigned char *buf, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= size; i += 4) {
+        uint32_t instr = ddelta_le32toh(buf + i);
+        uint32_t now = (uint32_t) ((pos + i) >> 2);
+
+        if ((instr >> 26) != 0x25)
+            continue;
+
+        instr = state->encode ? instr + now : instr - now;
+        ddelta_htole32(buf + i, 0x94000000 | (instr & 0x03FFFFFF));
+    }
+
+    return i;
+}
+
+void ddelta_filter_init(struct ddelta_filter_state *state,
+                        enum ddelta_filter filter, int encode)
+{
+    state->filter = filter;
+    state->encode = encode;
+    state->prev_mask = 0;
+    state->prev_pos = (uint32_t) 0 - 5;
+}
+
+size_t ddelta_filter_code(struct ddelta_filter_state *state, uint64_t pos,
+                          unsigned char *buf, size_t size)
+{
+    switch (state->filter) {
+    case DDELTA_FILTER_NONE:
+        return size;
+    case DDELTA_FILTER_X86:
+        return x86_code(state, pos, buf, size);
+    case DDELTA_FILTER_ARM64:
+        return arm64_code(state, pos, buf, size);
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef DDELTA_FILTER_H
+#define DDELTA_FILTER_H
+
+/* Internal interface of the filters shared by generate and apply */
+
+#include "ddelta.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * State of a ddelta_filter carried from one buffer of a file to the next.
+ */
+struct ddelta_filter_state {
+    enum ddelta_filter filter;
+    int encode;
+    /** x86: E8/E9 bytes seen before prev_pos */
+    uint32_t prev_mask;
+    /** x86: offset of the last E8/E9 byte seen */
+    uint32_t prev_pos;
+};
+
+/**
+ * Prepares state to encode or decode a file from its start.
+ */
+void ddelta_filter_init(struct ddelta_filter_state *state,
+                        enum ddelta_filter filter, int encode);
+
+/**
+ * Runs a filter over a buffer starting at offset pos of a file.
+ *
+ * Instructions extending past the end of the buffer cannot be converted, so
+ * this returns the number of bytes processed; the rest must be passed again
+ * with the following data, or left unconverted at the end of the file.
+ */
+size_t ddelta_filter_code(struct ddelta_filter_state *state, uint64_t pos,
+                          unsigned char *buf, size_t size);
+
+#endif
@@ -26,7 +26,10 @@
  */
 
 #define _POSIX_SOURCE
+/* For SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
 #include "ddelta.h"
+#include "ddelta_filter.h"
 
 #include <sys/types.h>
 
@@ -44,6 +47,35 @@
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
+/* Minimum length of a run of zero diff or extra bytes to get its own entry */
+#ifndef DDELTA_ZERO_RUN_MIN
+#define DDELTA_ZERO_RUN_MIN 4096
+#endif
+
+/* Block size the runs of zero diff bytes are aligned to in the old file */
+#ifndef DDELTA_ZERO_RUN_ALIGN
+#define DDELTA_ZERO_RUN_ALIGN 4096
+#endif
+
+/* A match found by the scan: |diff| bytes of new + |newpos| to be built
+ * from old + |oldpos| and diff data, followed by |extra| bytes of extra
+ * data, after which |seek| bytes of the old file are skipped. */
+struct ddelta_control {
+    off_t newpos;
+    off_t oldpos;
+    off_t diff;
+    off_t extra;
+    off_t seek;
+};
+
+/* A data region of the old file: |size| bytes at |oldpos| in the old file,
+ * stored at |packedpos| in the copy indexed by the suffix array. */
+struct ddelta_region {
+    off_t packedpos;
+    off_t oldpos;
+    off_t size;
+};
+
 static uint64_t ddelta_htobe64(uint64_t host)
 {
 #if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -72,13 +104,21 @@ static uint64_t ddelta_to_unsigned(int64_t i)
     return i >= 0 ? (uint64_t) i : ~(uint64_t)(-i) + 1;
 }
 
-static int ddelta_header_write(struct ddelta_header *header, FILE *file)
+static int ddelta_header_write(struct ddelta_header *header,
+                               enum ddelta_filter filter, FILE *file)
 {
+    uint64_t value = ddelta_htobe64(filter);
+
     header->new_file_size = ddelta_htobe64(header->new_file_size);
 
     if (fwrite(header, sizeof(*header), 1, file) < 1)
         return -DDELTA_EPATCHIO;
 
+    /* The old format has no filter field */
+    if (memcmp(header->magic, DDELTA_MAGIC, sizeof(header->magic)) != 0 &&
+        fwrite(&value, sizeof(value), 1, file) < 1)
+        return -DDELTA_EPATCHIO;
+
     return 0;
 }
 
@@ -95,6 +135,73 @@ static int ddelta_entry_header_write(struct ddelta_entry_header *entry,
     return 0;
 }
 
+static off_t zerolen(unsigned char *buf, off_t size)
+{
+    off_t i;
+
+    for (i = 0; i < size; i++)
+        if (buf[i] != 0)
+            break;
+
+    return i;
+}
+
+/* Writes an entry with |diff| bytes of diff data between |new| and |old|,
+ * followed by |extra| bytes of extra data from |new| + |diff|. If |zero| is
+ * set, the diff is known to be all zeroes and is not written out. Long runs
+ * of zeroes in the extra data are split off into entries of their own, the
+ * last entry carries the |seek|.
+ *
+ * If |pf| is NULL, nothing is written. Returns 1 if DDELTA_DIFF_ZERO or
+ * DDELTA_EXTRA_ZERO is used, 0 if not. */
+static int ddelta_entry_write(FILE *pf, unsigned char *old, unsigned char *new,
+                              off_t diff, int zero, off_t extra, off_t seek)
+{
+    struct ddelta_entry_header header;
+    off_t i, n, run;
+    int extra_zero;
+    int flags = 0;
+    int result;
+
+    do {
+        n = zerolen(new + diff, extra);
+        extra_zero = (n >= DDELTA_ZERO_RUN_MIN);
+        for (; !extra_zero && n < extra; n += run ? run : 1) {
+            run = zerolen(new + diff + n, extra - n);
+            if (run >= DDELTA_ZERO_RUN_MIN)
+                break;
+        }
+
+        flags |= zero || extra_zero;
+        if (pf == NULL)
+            goto next;
+
+        header.diff = (uint64_t) diff | (zero ? DDELTA_DIFF_ZERO : 0);
+        header.extra = (uint64_t) n | (extra_zero ? DDELTA_EXTRA_ZERO : 0);
+        header.seek.value = (n == extra) ? seek : 0;
+
+        if ((result = ddelta_entry_header_write(&header, pf)) < 0)
+            return result;
+
+        for (i = 0; !zero && i < diff; i++) {
+            if (fputc(new[i] - old[i], pf) == EOF)
+                return -DDELTA_EPATCHIO;
+        }
+
+        if (n && !extra_zero && fwrite(new + diff, n, 1, pf) < 1)
+            return -DDELTA_EPATCHIO;
+
+    next:
+        old += diff;
+        new += diff + n;
+        extra -= n;
+        diff = 0;
+        zero = 0;
+    } while (extra > 0);
+
+    return flags;
+}
+
 static off_t matchlen(unsigned char *old, off_t oldsize, unsigned char *new,
                       off_t newsize)
 {
@@ -107,6 +214,59 @@ static off_t matchlen(unsigned char *old, off_t oldsize, unsigned char *new,
     return i;
 }
 
+/* Writes the entries for |control|, using ddelta_entry_write(). Long runs of
+ * zero diff bytes are split off into entries of their own, so apply can copy
+ * them from the old file directly. The runs are trimmed to whole blocks of
+ * the old file, so file systems can share the blocks rather than copy them. */
+static int ddelta_control_write(FILE *pf, unsigned char *old, unsigned char *new,
+                                const struct ddelta_control *control)
+{
+    const off_t align = DDELTA_ZERO_RUN_ALIGN;
+    off_t i, run = 0, start = 0;
+    off_t zero_start = 0, zero_end;
+    int zero = 0;
+    int flags = 0;
+    int result;
+
+    old += control->oldpos;
+    new += control->newpos;
+
+    for (i = 0; i < control->diff; i += run ? run : 1) {
+        run = matchlen(old + i, control->diff - i,
+                       new + i, control->diff - i);
+        if (run < DDELTA_ZERO_RUN_MIN)
+            continue;
+
+        zero_start = (control->oldpos + i + align - 1) / align * align - control->oldpos;
+        zero_end = (control->oldpos + i + run) / align * align - control->oldpos;
+        if (zero_end - zero_start < DDELTA_ZERO_RUN_MIN)
+            continue;
+
+        if (zero_start > start &&
+            (result = ddelta_entry_write(pf, old + start, new + start,
+                                         zero_start - start, 0, 0, 0)) < 0)
+            return result;
+
+        flags = 1;
+        start = zero_end;
+        zero = (zero_end == control->diff);
+        if (!zero &&
+            (result = ddelta_entry_write(pf, old + zero_start, new + zero_start,
+                                         zero_end - zero_start, 1, 0, 0)) < 0)
+            return result;
+    }
+
+    /* The last entry carries the extra data and the seek */
+    if (zero)
+        start = zero_start;
+    if ((result = ddelta_entry_write(pf, old + start, new + start,
+                                     control->diff - start, zero,
+                                     control->extra, control->seek)) < 0)
+        return result;
+
+    return flags | result;
+}
+
 /* This is a binary search of the string |new_buf| of size |newsize| (or a
  * prefix of it) in the |old| string with size |oldsize| using the suffix array
  * |I|. |st| and |en| is the start and end of the search range (inclusive).
@@ -139,6 +299,118 @@ static off_t search(saidx_t *I, unsigned char *old, off_t oldsize,
     };
 }
 
+/* Finds the next data region of |old| at or after |*start|, skipping runs of
+ * DDELTA_ZERO_RUN_MIN or more zero bytes. Stores the start of the region in
+ * |*start| and returns its end, which equals |*start| if none is left. */
+static off_t next_region(unsigned char *old, off_t oldsize, off_t *start)
+{
+    off_t i, run;
+
+    for (i = *start; i < oldsize; i += run) {
+        run = zerolen(old + i, oldsize - i);
+        if (run < DDELTA_ZERO_RUN_MIN)
+            break;
+    }
+
+    *start = i;
+
+    for (; i < oldsize; i += run ? run : 1) {
+        run = zerolen(old + i, oldsize - i);
+        if (run >= DDELTA_ZERO_RUN_MIN)
+            break;
+    }
+
+    return i;
+}
+
+/* Builds the data regions of |old| in |*regions|, and a copy of them without
+ * the long runs of zeroes in between in |*packed|, which is |old| itself if
+ * there are no such runs. Returns the size of the copy, or -1 on error. */
+static off_t pack_old(unsigned char *old, off_t oldsize, unsigned char **packed,
+                      struct ddelta_region **regions, size_t *nregions)
+{
+    off_t start, end, packedsize = 0;
+    size_t n = 0;
+
+    for (start = 0; (end = next_region(old, oldsize, &start)) > start; start = end) {
+        packedsize += end - start;
+        n++;
+    }
+
+    if ((*regions = malloc((n ? n : 1) * sizeof(**regions))) == NULL)
+        return -1;
+
+    if (packedsize == oldsize)
+        *packed = old;
+    else if ((*packed = malloc(packedsize + 1)) == NULL)
+        return -1;
+
+    packedsize = 0;
+    n = 0;
+    for (start = 0; (end = next_region(old, oldsize, &start)) > start; start = end) {
+        (*regions)[n].packedpos = packedsize;
+        (*regions)[n].oldpos = start;
+        (*regions)[n].size = end - start;
+        if (*packed != old)
+            memcpy(*packed + packedsize, old + start, end - start);
+        packedsize += end - start;
+        n++;
+    }
+
+    *nregions = n;
+    return packedsize;
+}
+
+/* Converts the match of |len| bytes at |*pos| in the packed copy to the old
+ * file, cutting it off at the end of its data region. Returns the new length
+ * and stores the old file offset in |*pos|. */
+static off_t unpack_match(const struct ddelta_region *regions, size_t nregions,
+                          off_t len, off_t *pos)
+{
+    size_t lo = 0, hi = nregions, mid;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (regions[mid].packedpos <= *pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    len = MIN(len, regions[lo].packedpos + regions[lo].size - *pos);
+    *pos = regions[lo].oldpos + (*pos - regions[lo].packedpos);
+    return len;
+}
+
+/* Reads the data regions of the file |fd| of size |size| into the zeroed
+ * buffer |buf|. Holes are not read from the disk, |buf| is already zero
+ * there. */
+static off_t read_data(int fd, unsigned char *buf, off_t size)
+{
+    off_t data, hole = 0;
+
+    while (hole < size) {
+        data = hole;
+        hole = size;
+#ifdef SEEK_DATA
+        if ((data = lseek(fd, data, SEEK_DATA)) == -1) {
+            /* Only a hole is left */
+            if (errno == ENXIO)
+                break;
+            return -1;
+        }
+        if ((hole = lseek(fd, data, SEEK_HOLE)) == -1)
+            return -1;
+        hole = MIN(hole, size);
+#endif
+        if ((lseek(fd, data, SEEK_SET) != data) ||
+            (read(fd, buf + data, hole - data) != hole - data))
+            return -1;
+    }
+
+    return size;
+}
+
 static off_t read_file(int fd, unsigned char **buf)
 {
     off_t size;
@@ -146,22 +418,30 @@ static off_t read_file(int fd, unsigned char **buf)
         return -1;
 
     if (((size = lseek(fd, 0, SEEK_END)) == -1) ||
-        ((*buf = malloc(size + 1)) == NULL) ||
-        (lseek(fd, 0, SEEK_SET) != 0) ||
-        (read(fd, *buf, size) != size) || (close(fd) == -1))
+        ((*buf = calloc(size + 1, 1)) == NULL) ||
+        (read_data(fd, *buf, size) != size) || (close(fd) == -1))
         return -1;
 
     return size;
 }
 
 int ddelta_generate(int oldfd, int newfd, int patchfd)
+{
+    return ddelta_generate_filtered(oldfd, newfd, patchfd, DDELTA_FILTER_NONE);
+}
+
+int ddelta_generate_filtered(int oldfd, int newfd, int patchfd,
+                             enum ddelta_filter filter)
 {
     struct ddelta_header file_header = {
         DDELTA_MAGIC,
         0};
     struct ddelta_entry_header header;
-    unsigned char *old = NULL, *new = NULL;
-    off_t oldsize, newsize;
+    struct ddelta_filter_state state;
+    unsigned char *old = NULL, *new = NULL, *packed = NULL;
+    off_t oldsize, newsize, packedsize;
+    struct ddelta_region *regions = NULL;
+    size_t nregions = 0;
     saidx_t *I = NULL;
     off_t scan, pos = 0, len;
     off_t lastscan, lastpos, lastoffset;
@@ -169,6 +449,9 @@ int ddelta_generate(int oldfd, int newfd, int patchfd)
     off_t s, Sf, lenf, Sb, lenb;
     off_t overlap, Ss, lens;
     off_t i;
+    off_t zero_end = 0;
+    struct ddelta_control *controls = NULL;
+    size_t ncontrols = 0, maxcontrols = 0, k;
     FILE *pf = NULL;
     int result = 0;
 
@@ -181,12 +464,27 @@ int ddelta_generate(int oldfd, int newfd, int patchfd)
         goto out;
     }
 
-    if (((I = malloc((oldsize + 1) * sizeof(saidx_t))) == NULL)) {
+    if (filter > DDELTA_FILTER_ARM64) {
         result = -DDELTA_EALGO;
         goto out;
     }
 
-    if (divsufsort(old, I, (int32_t) oldsize)) {
+    ddelta_filter_init(&state, filter, 1);
+    ddelta_filter_code(&state, 0, old, oldsize);
+
+    /* Only the data regions are indexed. Long runs of zeroes, such as holes,
+     * are skipped in the new file by the scan below anyway. */
+    if ((packedsize = pack_old(old, oldsize, &packed, &regions, &nregions)) < 0) {
+        result = -DDELTA_EALGO;
+        goto out;
+    }
+
+    if (((I = malloc((packedsize + 1) * sizeof(saidx_t))) == NULL)) {
+        result = -DDELTA_EALGO;
+        goto out;
+    }
+
+    if (divsufsort(packed, I, (int32_t) packedsize)) {
         result = -DDELTA_EALGO;
         goto out;
     }
@@ -200,16 +498,15 @@ int ddelta_generate(int oldfd, int newfd, int patchfd)
         goto out;
     }
 
+    ddelta_filter_init(&state, filter, 1);
+    ddelta_filter_code(&state, 0, new, newsize);
+
     /* Create the patch file */
     if ((pf = fdopen(patchfd, "w")) == NULL) {
         result = -DDELTA_EPATCHIO;
         goto out;
     }
 
-    file_header.new_file_size = (uint64_t) newsize;
-    if ((result = ddelta_header_write(&file_header, pf)) < 0)
-        goto out;
-
     scan = 0;
     len = 0;
     lastscan = 0;
@@ -231,8 +528,30 @@ int ddelta_generate(int oldfd, int newfd, int patchfd)
             prev_oldscore = oldscore;
             prev_pos = pos;
 
-            len = search(I, old, oldsize - 1, new + scan, newsize - scan,
-                         0, oldsize, &pos);
+            if (packedsize > 0) {
+                len = search(I, packed, packedsize - 1, new + scan,
+                             newsize - scan, 0, packedsize, &pos);
+                len = unpack_match(regions, nregions, len, &pos);
+            } else {
+                len = 0;
+                pos = 0;
+            }
+
+            /* Skip long runs of zeroes, such as holes, that are not found
+             * in the old file as a whole, instead of searching at every byte
+             * of them or matching them piecewise. They end up as zero extra
+             * data. */
+            if (new[scan] == 0) {
+                if (zero_end <= scan)
+                    zero_end = scan + zerolen(new + scan, newsize - scan);
+                if (zero_end - scan >= DDELTA_ZERO_RUN_MIN &&
+                    zero_end - scan > len) {
+                    scan = zero_end - 1;
+                    scsc = zero_end;
+                    oldscore = 0;
+                    continue;
+                }
+            }
 
             for (; scsc < scan + len; scsc++)
                 if ((scsc + lastoffset < oldsize) &&
@@ -312,27 +631,23 @@ int ddelta_generate(int oldfd, int newfd, int patchfd)
                 goto out;
             }
 
-            header.diff = (uint64_t) lenf;
-            header.extra = (uint64_t)((scan - lenb) - (lastscan + lenf));
-            header.seek.value = (pos - lenb) - (lastpos + lenf);
+            if (ncontrols == maxcontrols) {
+                struct ddelta_control *c;
 
-            if ((result = ddelta_entry_header_write(&header, pf)) < 0)
-                goto out;
-
-            for (i = 0; i < lenf; i++) {
-                if (fputc(new[lastscan + i] - old[lastpos + i], pf) == EOF) {
-                    result = -DDELTA_EPATCHIO;
+                maxcontrols = maxcontrols ? 2 * maxcontrols : 1024;
+                if ((c = realloc(controls, maxcontrols * sizeof(*c))) == NULL) {
+                    result = -DDELTA_EALGO;
                     goto out;
                 }
+                controls = c;
             }
 
-            if ((scan - lenb) - (lastscan + lenf)) {
-                if (fwrite(new + lastscan + lenf,
-                           (scan - lenb) - (lastscan + lenf), 1, pf) < 1) {
-                    result = -DDELTA_EPATCHIO;
-                    goto out;
-                }
-            }
+            controls[ncontrols].newpos = lastscan;
+            controls[ncontrols].oldpos = lastpos;
+            controls[ncontrols].diff = lenf;
+            controls[ncontrols].extra = (scan - lenb) - (lastscan + lenf);
+            controls[ncontrols].seek = (pos - lenb) - (lastpos + lenf);
+            ncontrols++;
 
             lastscan = scan - lenb;
             lastpos = pos - lenb;
@@ -340,6 +655,26 @@ int ddelta_generate(int oldfd, int newfd, int patchfd)
         };
     };
 
+    /* The entry flags are only understood by readers of the extended format,
+     * so check if they are needed before writing the header. */
+    for (k = 0; k < ncontrols; k++) {
+        if ((result = ddelta_control_write(NULL, old, new, &controls[k])) < 0)
+            goto out;
+        if (result > 0)
+            break;
+    }
+
+    file_header.new_file_size = (uint64_t) newsize;
+    if (k < ncontrols || filter != DDELTA_FILTER_NONE)
+        memcpy(file_header.magic, DDELTA_MAGIC_EXTENDED, sizeof(file_header.magic));
+    if ((result = ddelta_header_write(&file_header, filter, pf)) < 0)
+        goto out;
+
+    for (k = 0; k < ncontrols; k++) {
+        if ((result = ddelta_control_write(pf, old, new, &controls[k])) < 0)
+            goto out;
+    }
+
     memset(&header, 0, sizeof(header));
     if ((result = ddelta_entry_header_write(&header, pf)) < 0)
         goto out;
@@ -357,7 +692,11 @@ out:
     }
 
     /* Free the memory we used */
+    free(controls);
     free(I);
+    if (packed != old)
+        free(packed);
+    free(regions);
     free(old);
     free(new);
 
@@ -371,9 +710,14 @@ int main(int argc, char *argv[])
     int newfd;
     int patchfd;
     int err;
-
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s oldfile newfile patchfile\n", argv[0]);
+    enum ddelta_filter filter = DDELTA_FILTER_NONE;
+
+    if (argc == 5 && strcmp(argv[4], "x86") == 0) {
+        filter = DDELTA_FILTER_X86;
+    } else if (argc == 5 && strcmp(argv[4], "arm64") == 0) {
+        filter = DDELTA_FILTER_ARM64;
+    } else if (argc != 4) {
+        fprintf(stderr, "usage: %s oldfile newfile patchfile [x86|arm64]\n", argv[0]);
         return 1;
     }
 
@@ -394,7 +738,7 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    err = ddelta_generate(oldfd, newfd, patchfd);
+    err = ddelta_generate_filtered(oldfd, newfd, patchfd, filter);
     if (err < 0) {
         fprintf(stderr, "An error %d occured: %s", -err, strerror(errno));
         return -err;
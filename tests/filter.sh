@@ -0,0 +1,58 @@
+#!/bin/sh
+# Filtered patches must reproduce the new file exactly, including branches
+# held back across the 32 KiB blocks apply writes in, sizes that are not a
+# multiple of 4, and zero extra data written through the filter.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# put FILE OFFSET BYTES: overwrite bytes (printf escapes) at OFFSET of FILE
+put() {
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+for filter in x86 arm64; do
+    head -c 100001 /dev/urandom > "$dir/old"
+
+    {
+        head -c 1000 "$dir/old"
+        printf 'abc'
+        tail -c +1001 "$dir/old" | head -c 49000
+        head -c 8192 /dev/zero
+        head -c 777 /dev/urandom
+        tail -c +50001 "$dir/old"
+    } > "$dir/new"
+
+    for file in "$dir/old" "$dir/new"; do
+        case $filter in
+        x86)
+            put "$file" 32765 '\350\020\000\000\000'
+            put "$file" 65534 '\351\360\377\377\377'
+            put "$file" 98302 '\350\000\001\000\000'
+            ;;
+        arm64)
+            put "$file" 32764 '\001\000\000\224'
+            put "$file" 32768 '\377\377\377\227'
+            put "$file" 65532 '\000\001\000\224'
+            put "$file" 98304 '\020\000\000\224'
+            ;;
+        esac
+    done
+
+    ./ddelta_generate "$dir/old" "$dir/new" "$dir/patch" $filter
+    ./ddelta_apply "$dir/old" "$dir/out" "$dir/patch" > /dev/null
+    cmp "$dir/new" "$dir/out"
+
+    magic=$(head -c 8 "$dir/patch")
+    if [ "$magic" != DDELTA41 ]; then
+        echo "filter: $filter patch has magic $magic" >&2
+        exit 1
+    fi
+
+    # The zeroes must be an omitted extra run (DDELTA_EXTRA_ZERO | 8192)
+    if ! od -An -v -tx1 "$dir/patch" | tr -d ' \n' | grep -q 8000000000002000; then
+        echo "filter: $filter patch stores the zeroes" >&2
+        exit 1
+    fi
+done
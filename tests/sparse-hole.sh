@@ -0,0 +1,32 @@
+#!/bin/sh
+# A long hole in the new file must become zero extra data, rather than be
+# matched piecewise against the short runs of zeroes in the old file.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+i=0
+while [ $i -lt 200 ]; do
+    head -c 500 /dev/urandom
+    head -c 200 /dev/zero
+    i=$((i + 1))
+done > "$dir/old"
+cp "$dir/old" "$dir/new"
+truncate -s +4M "$dir/new"
+
+./ddelta_generate "$dir/old" "$dir/new" "$dir/patch"
+./ddelta_apply "$dir/old" "$dir/out" "$dir/patch" > /dev/null
+cmp "$dir/new" "$dir/out"
+
+size=$(wc -c < "$dir/patch")
+if [ "$size" -gt 65536 ]; then
+    echo "sparse-hole: patch is $size bytes" >&2
+    exit 1
+fi
+
+allocated=$(du -k "$dir/out" | cut -f1)
+if [ "$allocated" -gt 1024 ]; then
+    echo "sparse-hole: output has $allocated KiB allocated" >&2
+    exit 1
+fi
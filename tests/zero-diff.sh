@@ -0,0 +1,114 @@
+#!/bin/sh
+# Runs of zero diff bytes must be split off into DDELTA_DIFF_ZERO entries
+# aligned to 4 KiB blocks of the old file, and copied from the old file by
+# each ddelta_apply build given as an argument.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# entries PATCH: print "diff_zero diff extra_zero extra seek oldpos" per entry
+entries() {
+    od -An -v -tu1 "$1" | awk '
+        function num(p, flag, v, k) {
+            v = b[p] - (flag ? 128 : 0)
+            for (k = 1; k < 8; k++)
+                v = v * 256 + b[p + k]
+            return v
+        }
+        function snum(p, v, k) {
+            if (b[p] < 128)
+                return num(p, 0)
+            for (k = 0; k < 8; k++)
+                v = v * 256 + 255 - b[p + k]
+            return -v - 1
+        }
+        { for (i = 1; i <= NF; i++) b[n++] = $i }
+        END {
+            p = b[7] == 49 ? 24 : 16
+            while (p < n) {
+                dz = b[p] >= 128; diff = num(p, dz)
+                ez = b[p + 8] >= 128; extra = num(p + 8, ez)
+                seek = snum(p + 16)
+                if (!dz && !ez && diff == 0 && extra == 0 && seek == 0)
+                    break
+                print dz, diff, ez, extra, seek, oldpos + 0
+                p += 24 + (dz ? 0 : diff) + (ez ? 0 : extra)
+                oldpos += diff + seek
+            }
+        }'
+}
+
+# check APPLY NAME: apply $dir/patch to $dir/old, through a pipe if NAME
+# is pipe, and compare the result to $dir/new
+check() {
+    rm -f "$dir/out"
+    if [ "$2" = pipe ]; then
+        mkfifo "$dir/fifo"
+        cat "$dir/fifo" > "$dir/out" &
+        "$1" "$dir/old" "$dir/fifo" "$dir/patch" > /dev/null
+        wait
+        rm -f "$dir/fifo"
+    else
+        "$1" "$dir/old" "$dir/out" "$dir/patch" > /dev/null
+    fi
+    if ! cmp "$dir/new" "$dir/out"; then
+        echo "zero-diff: $1 failed on $2" >&2
+        exit 1
+    fi
+}
+
+magic() {
+    magic=$(head -c 8 "$dir/patch")
+    if [ "$magic" != "$1" ]; then
+        echo "zero-diff: $2 patch has magic $magic" >&2
+        exit 1
+    fi
+}
+
+# A large file with a small edit: the unchanged runs around the edit
+# become zero diff entries covering whole old file blocks only
+head -c 4194311 /dev/urandom > "$dir/old"
+cp "$dir/old" "$dir/new"
+printf 'edited' | dd of="$dir/new" bs=1 seek=2000003 conv=notrunc 2> /dev/null
+./ddelta_generate "$dir/old" "$dir/new" "$dir/patch"
+magic DDELTA41 edit
+entries "$dir/patch" > "$dir/entries"
+if ! awk '$1 && ($2 % 4096 || $6 % 4096) { exit 1 }
+          $1 { zero += $2 } END { exit zero < 4096 * 1000 }' "$dir/entries"; then
+    echo "zero-diff: edit patch has unaligned or missing zero runs" >&2
+    cat "$dir/entries" >&2
+    exit 1
+fi
+for apply; do
+    check "$apply" edit
+    check "$apply" pipe
+done
+
+# A zero run ending the diff of a match: its entry must carry the extra
+# data and the seek that follows the match
+head -c 65536 /dev/urandom > "$dir/old"
+{
+    head -c 16384 "$dir/old"
+    head -c 1000 /dev/urandom
+    tail -c +21385 "$dir/old"
+} > "$dir/new"
+./ddelta_generate "$dir/old" "$dir/new" "$dir/patch"
+magic DDELTA41 end
+if ! entries "$dir/patch" | awk '$1 && $4 && $5 { found = 1 } END { exit !found }'; then
+    echo "zero-diff: no zero diff entry with extra data and seek" >&2
+    entries "$dir/patch" >&2
+    exit 1
+fi
+for apply; do
+    check "$apply" end
+done
+
+# Without long runs, the patch must stay in the original format
+head -c 3000 /dev/urandom > "$dir/old"
+head -c 3000 /dev/urandom > "$dir/new"
+./ddelta_generate "$dir/old" "$dir/new" "$dir/patch"
+magic DDELTA40 short
+for apply; do
+    check "$apply" short
+done